@@ -1,5 +1,11 @@
 #include "language_vector.hpp"
 #include <vector>
+#include <array>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <numeric>
 #include <random>
 #include <algorithm>
 #include <iostream>
@@ -40,6 +46,76 @@ namespace {
     }
   }
 
+  // Coarse Unicode script buckets, used to prefilter candidate languages
+  enum script {
+    script_common, // whitespace, digits, punctuation & symbols (incl. emoji) - ignored when prefiltering
+    script_latin,
+    script_greek,
+    script_cyrillic,
+    script_armenian,
+    script_hebrew,
+    script_arabic,
+    script_indic,
+    script_thai,
+    script_georgian,
+    script_hangul,
+    script_kana,
+    script_han,
+    script_other,  // a mix of unrelated scripts - also ignored when prefiltering
+    script_count
+  };
+
+  // Map a code point onto its (approximate) script, using a few range checks
+  script script_of(char32_t c) {
+    if (c < 0x80) {
+      return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') ? script_latin : script_common;
+    }
+    if (c < 0xC0 || c == 0xD7 || c == 0xF7) { return script_common; }
+    if (c < 0x250 || (0x1E00 <= c && c < 0x1F00) || (0x2C60 <= c && c < 0x2C80) ||
+        (0xA720 <= c && c < 0xA800)) { return script_latin; }
+    if (c < 0x370) { return script_common; }
+    if (c < 0x400 || (0x1F00 <= c && c < 0x2000)) { return script_greek; }
+    if (c < 0x530 || (0x2DE0 <= c && c < 0x2E00) ||
+        (0xA640 <= c && c < 0xA6A0)) { return script_cyrillic; }
+    if (c < 0x590) { return script_armenian; }
+    if (c < 0x600) { return script_hebrew; }
+    if (c < 0x780 || (0x8A0 <= c && c < 0x900)) { return script_arabic; }
+    if (0x900 <= c && c < 0xE00) { return script_indic; }
+    if (0xE00 <= c && c < 0xF00) { return script_thai; }
+    if ((0x10A0 <= c && c < 0x1100) || (0x2D00 <= c && c < 0x2D30)) { return script_georgian; }
+    if ((0x1100 <= c && c < 0x1200) || (0x3130 <= c && c < 0x3190) ||
+        (0xAC00 <= c && c < 0xD7B0)) { return script_hangul; }
+    // general punctuation, symbols, arrows, dingbats, supplemental punctuation,
+    // ideographic description & CJK punctuation
+    if ((0x2000 <= c && c < 0x2C00) || (0x2E00 <= c && c < 0x2E80) ||
+        (0x2FF0 <= c && c < 0x3040)) { return script_common; }
+    if (0x3040 <= c && c < 0x3100) { return script_kana; }
+    if ((0x2E80 <= c && c < 0x2FE0) || (0x3400 <= c && c < 0xA000) ||
+        (0xF900 <= c && c < 0xFB00) || (0x20000 <= c && c < 0x40000)) { return script_han; }
+    // presentation forms
+    if (0xFB00 <= c && c < 0xFB07) { return script_latin; }
+    if (0xFB1D <= c && c < 0xFB50) { return script_hebrew; }
+    if ((0xFB50 <= c && c < 0xFE00) || (0xFE70 <= c && c < 0xFEFF)) { return script_arabic; }
+    // halfwidth & fullwidth forms (fullwidth ASCII is treated as its ASCII equivalent)
+    if (0xFF01 <= c && c < 0xFF5F) { return script_of(c - 0xFEE0); }
+    if (0xFF65 <= c && c < 0xFFA0) { return script_kana; }
+    if (0xFFA0 <= c && c < 0xFFDD) { return script_hangul; }
+    // variation selectors, CJK compatibility & small forms, byte order mark, specials,
+    // emoji & other symbols, tags
+    if ((0xFE00 <= c && c < 0xFE70) || c == 0xFEFF || (0xFF00 <= c && c < 0x10000) ||
+        (0x1F000 <= c && c < 0x1FC00) || (0xE0000 <= c && c < 0xE0080)) { return script_common; }
+    return script_other;
+  }
+
+  // Marks the start of the script profile in a saved vector
+  const std::string script_marker = "scripts";
+
+  // Allocate a new, unique 'vector_impl::id'
+  uint64_t next_id() {
+    static std::atomic<uint64_t> counter{0};
+    return ++counter;
+  }
+
 } // namespace (anonymous)
 
 
@@ -50,6 +126,13 @@ namespace language_vector {
   struct vector_impl {
     typedef std::vector<int64_t> data_t;
     data_t data;
+
+    // Number of characters seen from each script (see 'script_of')
+    typedef std::array<int64_t, script_count> scripts_t;
+    scripts_t scripts;
+
+    // Unique version of the contents, reassigned whenever they change (see 'cache')
+    uint64_t id;
   };
 
   struct builder_impl {
@@ -95,6 +178,7 @@ namespace language_vector {
                                    const bool addSpace=true) const {
     const size_t n = permutation.size();
     vector_impl::data_t result(n, 0);
+    vector_impl::scripts_t scripts{};
 
     // Working data - space for ngrams, temporary/scratch space,
     // and for memorized character vectors
@@ -119,6 +203,7 @@ namespace language_vector {
       }
       // Increment pointer by amount of bytes for current UTF32 value
       ptr += rc;
+      ++scripts[script_of(c32)];
       // The oldest character should be removed from the ngram
       auto oldest_buffer_it = buffer_it + 1;
       if (oldest_buffer_it == std::end(buffer)) {
@@ -159,13 +244,14 @@ namespace language_vector {
     }
 
     // Wrap the result up to return to caller
-    return new vector{std::unique_ptr<vector_impl>{new vector_impl{std::move(result)}}};
+    return new vector{std::unique_ptr<vector_impl>{new vector_impl{std::move(result), scripts, next_id()}}};
   }
 
   vector* builder_impl::operator()(const std::vector<std::string>& lines,
                                    const bool addSpace=true) const {
     const size_t n = permutation.size();
     vector_impl::data_t result(n, 0);
+    vector_impl::scripts_t scripts{};
 
     for (auto text : lines) {
       // Working data - space for ngrams, temporary/scratch space,
@@ -191,6 +277,7 @@ namespace language_vector {
         }
         // Increment pointer by amount of bytes for current UTF32 value
         ptr += rc;
+        ++scripts[script_of(c32)];
         // The oldest character should be removed from the ngram
         auto oldest_buffer_it = buffer_it + 1;
         if (oldest_buffer_it == std::end(buffer)) {
@@ -231,7 +318,7 @@ namespace language_vector {
       }
     }
     // Wrap the result up to return to caller
-    return new vector{std::unique_ptr<vector_impl>{new vector_impl{std::move(result)}}};
+    return new vector{std::unique_ptr<vector_impl>{new vector_impl{std::move(result), scripts, next_id()}}};
   }
 
   void merge(vector& language, const vector& text) {
@@ -239,6 +326,12 @@ namespace language_vector {
                   [](int64_t& a, int64_t b) {
                     a += b;
                   });
+    for_each_pair(language.impl->scripts, text.impl->scripts,
+                  [](int64_t& a, int64_t b) {
+                    a += b;
+                  });
+    // only change the id once the contents are updated (see 'cache')
+    language.impl->id = next_id();
   }
 
   void wmerge(vector& language, const vector& text, int64_t weight) {
@@ -246,6 +339,52 @@ namespace language_vector {
                   [](int64_t& a, int64_t b) {
                     a += b;
                   });
+    for_each_triple(language.impl->scripts, text.impl->scripts, weight,
+                  [](int64_t& a, int64_t b) {
+                    a += b;
+                  });
+    language.impl->id = next_id();
+  }
+
+  bool compatible(const vector& language, const vector& text) {
+    const auto& lang = language.impl->scripts;
+    const auto& txt = text.impl->scripts;
+    int64_t lang_total = 0;
+    int64_t text_total = 0;
+    // 'common' & 'other' don't tell languages apart
+    for (auto s = script_latin; s < script_other; s = static_cast<script>(s + 1)) {
+      lang_total += lang[s];
+      text_total += txt[s];
+    }
+    // No evidence either way (e.g. digits only, or a language loaded without a profile)
+    if (lang_total <= 0 || text_total <= 0) {
+      return true;
+    }
+    // A script is part of the language if it accounts for at least 1/1000 of its characters
+    // (so that stray foreign words in the training data are ignored), and the text is
+    // compatible if any of its scripts are part of the language - mixed text is common
+    // (e.g. brand names), so even a minority script is enough to keep a language
+    for (auto s = script_latin; s < script_other; s = static_cast<script>(s + 1)) {
+      if (txt[s] > 0 && 1000 * lang[s] >= lang_total) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::vector<std::size_t> prefilter(const std::vector<const vector*>& languages,
+                                     const vector& text, const bool fallback) {
+    std::vector<std::size_t> result;
+    for (auto i = 0u; i < languages.size(); ++i) {
+      if (compatible(*languages[i], text)) {
+        result.push_back(i);
+      }
+    }
+    if (result.empty() && fallback) {
+      result.resize(languages.size());
+      std::iota(std::begin(result), std::end(result), 0);
+    }
+    return result;
   }
 
   float score(const vector& language, const vector& text) {
@@ -262,6 +401,204 @@ namespace language_vector {
     return sum_ab / std::sqrt(sum_aa * sum_bb + 1e-9f);
   }
 
+  results classify(const builder& b, const std::vector<const vector*>& languages,
+                   const std::string& text, std::size_t k, prefilter_mode mode) {
+    std::unique_ptr<vector> text_vector{b(text)};
+    std::vector<std::size_t> candidates;
+    if (mode == prefilter_none) {
+      candidates.resize(languages.size());
+      std::iota(std::begin(candidates), std::end(candidates), 0);
+    } else {
+      candidates = prefilter(languages, *text_vector, mode == prefilter_fallback);
+    }
+    results result;
+    for (auto i : candidates) {
+      result.emplace_back(i, score(*languages[i], *text_vector));
+    }
+    k = std::min(k, result.size());
+    std::partial_sort(std::begin(result), std::begin(result) + k, std::end(result),
+                      [](const results::value_type& a, const results::value_type& b) {
+                        return a.second > b.second;
+                      });
+    result.resize(k);
+    return result;
+  }
+
+  // *** Cache ***
+
+  struct cache_impl {
+    enum kind_t { kind_classification, kind_text_vector };
+
+    // Everything (other than the text & kind) that the cached value depends on:
+    //   [k or addSpace, order, n, seed, prefilter mode, language ids...]
+    typedef std::vector<uint64_t> context_t;
+
+    struct key_t {
+      kind_t kind;
+      std::string text;
+      context_t context;
+      std::size_t hash;
+
+      key_t(kind_t kind, const std::string& text, context_t&& context);
+      bool operator==(const key_t& other) const {
+        return hash == other.hash && kind == other.kind &&
+          text == other.text && context == other.context;
+      }
+    };
+
+    struct entry_t {
+      key_t key;
+      results classification;
+      std::unique_ptr<vector_impl> text_vector;
+    };
+
+    // The index refers to the key inside each entry (list elements never move)
+    struct key_ptr_hash {
+      std::size_t operator()(const key_t* key) const { return key->hash; }
+    };
+    struct key_ptr_equal {
+      bool operator()(const key_t* a, const key_t* b) const { return *a == *b; }
+    };
+
+    // Entries are kept in recency order (most recent first), with an index
+    // for lookup - all under the shard's lock
+    struct shard_t {
+      std::mutex mutex;
+      std::size_t capacity = 0;
+      std::list<entry_t> entries;
+      std::unordered_map<const key_t*, std::list<entry_t>::iterator,
+                         key_ptr_hash, key_ptr_equal> index;
+      std::size_t hits = 0;
+      std::size_t misses = 0;
+      std::size_t evictions = 0;
+    };
+
+    std::vector<shard_t> shards;
+
+    cache_impl(std::size_t capacity, std::size_t nshards);
+
+    static context_t context(const builder& b, uint64_t option);
+
+    shard_t& shard(const key_t& key) { return shards[key.hash % shards.size()]; }
+
+    // Look up 'key', copying the entry's value into 'out' if found
+    bool find(const key_t& key, entry_t& out);
+    void insert(entry_t&& entry);
+  };
+
+  cache_impl::key_t::key_t(kind_t _kind, const std::string& _text, context_t&& _context)
+    : kind{_kind}, text{_text}, context{std::move(_context)},
+      hash{std::hash<std::string>()(text)} {
+    hash ^= kind;
+    for (auto x : context) {
+      hash ^= std::hash<uint64_t>()(x) + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+    }
+  }
+
+  cache_impl::cache_impl(std::size_t capacity, std::size_t nshards)
+    : shards(std::max<std::size_t>(1, std::min(capacity, nshards))) {
+    // split the capacity exactly, so the total never exceeds it
+    for (auto i = 0u; i < shards.size(); ++i) {
+      shards[i].capacity = capacity / shards.size() + (i < capacity % shards.size() ? 1 : 0);
+    }
+  }
+
+  cache_impl::context_t cache_impl::context(const builder& b, uint64_t option) {
+    return context_t{option, b.impl->order, b.impl->permutation.size(), b.impl->seed};
+  }
+
+  bool cache_impl::find(const key_t& key, entry_t& out) {
+    auto& shard = this->shard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(&key);
+    // (a text vector entry should always have its vector, but never return an empty one)
+    if (it != std::end(shard.index) &&
+        (key.kind != kind_text_vector || it->second->text_vector)) {
+      auto entry = it->second;
+      shard.entries.splice(std::begin(shard.entries), shard.entries, entry);
+      out.classification = entry->classification;
+      if (entry->text_vector) {
+        out.text_vector.reset(new vector_impl(*entry->text_vector));
+      }
+      ++shard.hits;
+      return true;
+    }
+    ++shard.misses;
+    return false;
+  }
+
+  void cache_impl::insert(entry_t&& entry) {
+    auto& shard = this->shard(entry.key);
+    if (shard.capacity == 0) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(&entry.key);
+    if (it != std::end(shard.index)) {
+      // another thread got here first - just refresh it
+      *it->second = std::move(entry);
+      shard.entries.splice(std::begin(shard.entries), shard.entries, it->second);
+      return;
+    }
+    shard.entries.push_front(std::move(entry));
+    shard.index.emplace(&shard.entries.front().key, std::begin(shard.entries));
+
+    // evict least recently used
+    while (shard.entries.size() > shard.capacity) {
+      shard.index.erase(&shard.entries.back().key);
+      shard.entries.pop_back();
+      ++shard.evictions;
+    }
+  }
+
+  results cache::classify(const builder& b, const std::vector<const vector*>& languages,
+                          const std::string& text, std::size_t k, prefilter_mode mode) {
+    auto context = cache_impl::context(b, k);
+    context.push_back(mode);
+    for (auto language : languages) {
+      context.push_back(language->impl->id);
+    }
+    cache_impl::entry_t entry{{cache_impl::kind_classification, text, std::move(context)}, {}, {}};
+    if (impl->find(entry.key, entry)) {
+      return entry.classification;
+    }
+    entry.classification = language_vector::classify(b, languages, text, k, mode);
+    auto result = entry.classification;
+    impl->insert(std::move(entry));
+    return result;
+  }
+
+  vector* cache::build(const builder& b, const std::string& text, const bool addSpace) {
+    cache_impl::entry_t entry{{cache_impl::kind_text_vector, text, cache_impl::context(b, addSpace)}, {}, {}};
+    if (!impl->find(entry.key, entry)) {
+      std::unique_ptr<vector> result{b(text, addSpace)};
+      entry.text_vector.reset(new vector_impl(*result->impl));
+      impl->insert(std::move(entry));
+      return result.release();
+    }
+    return new vector{std::move(entry.text_vector)};
+  }
+
+  cache::statistics cache::stats() const {
+    statistics result{0, 0, 0, 0};
+    for (auto& shard : impl->shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      result.hits += shard.hits;
+      result.misses += shard.misses;
+      result.evictions += shard.evictions;
+      result.size += shard.entries.size();
+    }
+    return result;
+  }
+
+  void cache::clear() {
+    for (auto& shard : impl->shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.index.clear();
+      shard.entries.clear();
+    }
+  }
+
   // *** API wrappers ***
 
   vector::vector(std::unique_ptr<vector_impl>&& _impl) : impl{std::move(_impl)} { }
@@ -285,6 +622,11 @@ namespace language_vector {
     for (auto x : language.impl->data) {
       out << x << "\n";
     }
+    // followed by the script profile, after a marker line
+    out << script_marker << "\n";
+    for (auto x : language.impl->scripts) {
+      out << x << "\n";
+    }
   }
 
   vector* builder::load(std::istream& in) const {
@@ -296,11 +638,34 @@ namespace language_vector {
       in >> value;
       data.push_back(value);
     }
-    return new vector{std::unique_ptr<vector_impl>{new vector_impl{std::move(data)}}};
+    // the script profile is optional (older files don't have one, and may be followed by
+    // another vector) - only read it if the marker is next, otherwise leave it empty
+    vector_impl::scripts_t scripts{};
+    if (in && !(in >> std::ws).eof() && in.peek() == script_marker[0]) {
+      std::string marker;
+      in >> marker;
+      for (auto& x : scripts) {
+        in >> x;
+      }
+      if (!in || marker != script_marker) {
+        scripts.fill(0);
+      }
+    } else if (!in.fail()) {
+      // (don't report reaching the end of an old-format stream as an error)
+      in.clear();
+    }
+    return new vector{std::unique_ptr<vector_impl>{new vector_impl{std::move(data), scripts, next_id()}}};
   }
 
   builder* make_builder(std::size_t order, std::size_t n, std::size_t seed) {
     return new builder{std::unique_ptr<builder_impl>{new builder_impl{order, n, seed}}};
   }
 
+  cache::cache(std::unique_ptr<cache_impl>&& _impl) : impl{std::move(_impl)} { }
+  cache::~cache() { }
+
+  cache* make_cache(std::size_t capacity, std::size_t shards) {
+    return new cache{std::unique_ptr<cache_impl>{new cache_impl{capacity, shards}}};
+  }
+
 } // namespace language_vector
@@ -5,6 +5,7 @@
 #include <memory>
 #include <iosfwd>
 #include <vector>
+#include <utility>
 
 namespace language_vector {
 
@@ -54,6 +55,66 @@ namespace language_vector {
   //   -1 => worst match
   float score(const vector& language, const vector& text);
 
+  // Is any of 'text' written in the scripts (Latin, Cyrillic, Han, etc.) that 'language'
+  // was built from? (If either has no script information, assume it is.)
+  bool compatible(const vector& language, const vector& text);
+
+  // Select the indices of 'languages' which are compatible with 'text', and so worth
+  // scoring - if there are none, return all indices (or none, if not 'fallback')
+  std::vector<std::size_t> prefilter(const std::vector<const vector*>& languages,
+                                     const vector& text, const bool fallback=true);
+
+  // (index, score) pairs from 'classify', best first
+  typedef std::vector<std::pair<std::size_t, float>> results;
+
+  // How 'classify' uses 'prefilter' to select the languages to score
+  enum prefilter_mode {
+    prefilter_none,     // score every language
+    prefilter_strict,   // score only compatible languages (possibly none)
+    prefilter_fallback  // score only compatible languages, or every language if none are
+  };
+
+  // Classify 'text', returning the best 'k' matches from 'languages' - fewer than 'k'
+  // are returned if there are fewer languages, or fewer pass the prefilter
+  results classify(const builder& b, const std::vector<const vector*>& languages,
+                   const std::string& text, std::size_t k=1,
+                   prefilter_mode mode=prefilter_fallback);
+
+  // A bounded, thread-safe (sharded LRU) cache of classification results & text vectors.
+  // Entries are keyed by the input text, the builder's parameters and the current version
+  // of each language vector (which changes on load or merge), so they never go stale.
+  // (Merging into a language while it is being used to classify is not supported.)
+  struct cache_impl;
+  struct cache {
+    struct statistics {
+      std::size_t hits;
+      std::size_t misses;
+      std::size_t evictions;
+      std::size_t size;
+    };
+
+    // As 'language_vector::classify', but reusing previous results for the same input
+    results classify(const builder& b, const std::vector<const vector*>& languages,
+                     const std::string& text, std::size_t k=1,
+                     prefilter_mode mode=prefilter_fallback);
+
+    // As 'builder::operator()', but reusing previously built text vectors
+    vector* build(const builder& b, const std::string& text, const bool addSpace=true);
+
+    statistics stats() const;
+
+    // Remove all entries (statistics are kept)
+    void clear();
+
+    explicit cache(std::unique_ptr<cache_impl>&&);
+    ~cache();
+    std::unique_ptr<cache_impl> impl;
+  };
+
+  // Create a cache holding (up to) 'capacity' entries, split across 'shards'
+  // independently locked shards
+  cache* make_cache(std::size_t capacity, std::size_t shards=16);
+
 } // namespace language_vector
 
 #endif // LANGUAGE_VECTOR_HPP
@@ -34,6 +34,26 @@ namespace {
     return f();
   }
 
+  // Unwrap a Python sequence of language vectors
+  bool unwrap_languages(PyObject* pylanguages, std::vector<const language_vector::vector*>& languages) {
+    PyObject* sequence = PySequence_Fast(pylanguages, "languages must be a sequence");
+    if (!sequence) {
+      return false;
+    }
+    Py_ssize_t size = PySequence_Fast_GET_SIZE(sequence);
+    PyObject** items = PySequence_Fast_ITEMS(sequence);
+    for (auto i = 0; i < size; ++i) {
+      languages.push_back(unwrap_object<language_vector::vector>(items[i]));
+    }
+    Py_DECREF(sequence);
+    return true;
+  }
+
+  // Functions taking keyword arguments are stored in PyMethodDef as a PyCFunction
+  PyCFunction with_keywords(PyCFunctionWithKeywords f) {
+    return reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)()>(f));
+  }
+
   // Wrapper functions
 
   PyObject* make_builder(PyObject* /*self*/, PyObject* args) {
@@ -140,6 +160,112 @@ namespace {
     return Py_BuildValue("f", result);
   }
 
+  PyObject* prefilter(PyObject* /*self*/, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = { "languages", "text", "fallback", nullptr };
+    PyObject* pylanguages;
+    PyObject* pytext;
+    int fallback = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|p", const_cast<char**>(keywords),
+                                     &pylanguages, &pytext, &fallback)) {
+      return nullptr;
+    }
+    std::vector<const language_vector::vector*> languages;
+    if (!unwrap_languages(pylanguages, languages)) {
+      return nullptr;
+    }
+    auto text = unwrap_object<language_vector::vector>(pytext);
+    auto indices = allow_threads([&languages, text, fallback]
+                                 { return language_vector::prefilter(languages, *text, fallback); });
+    PyObject* result = PyList_New(indices.size());
+    for (auto i = 0u; i < indices.size(); ++i) {
+      PyList_SET_ITEM(result, i, PyLong_FromSize_t(indices[i]));
+    }
+    return result;
+  }
+
+  PyObject* classify(PyObject* /*self*/, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = { "builder", "languages", "text", "k", "cache",
+                                      "prefilter", "fallback", nullptr };
+    PyObject* pybuilder;
+    PyObject* pylanguages;
+    const char* text;
+    size_t k = 1;
+    PyObject* pycache = Py_None;
+    int use_prefilter = 1;
+    int fallback = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOs|KOpp", const_cast<char**>(keywords),
+                                     &pybuilder, &pylanguages, &text, &k, &pycache,
+                                     &use_prefilter, &fallback)) {
+      return nullptr;
+    }
+    auto mode = !use_prefilter ? language_vector::prefilter_none
+      : fallback ? language_vector::prefilter_fallback
+      : language_vector::prefilter_strict;
+    auto builder = unwrap_object<language_vector::builder>(pybuilder);
+    std::vector<const language_vector::vector*> languages;
+    if (!unwrap_languages(pylanguages, languages)) {
+      return nullptr;
+    }
+    auto cache = (pycache == Py_None) ? nullptr : unwrap_object<language_vector::cache>(pycache);
+    auto results = allow_threads([builder, &languages, &text, k, cache, mode] {
+        return cache ? cache->classify(*builder, languages, text, k, mode)
+                     : language_vector::classify(*builder, languages, text, k, mode);
+      });
+    PyObject* result = PyList_New(results.size());
+    for (auto i = 0u; i < results.size(); ++i) {
+      PyList_SET_ITEM(result, i, Py_BuildValue("(nf)", results[i].first, results[i].second));
+    }
+    return result;
+  }
+
+  PyObject* make_cache(PyObject* /*self*/, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = { "capacity", "shards", nullptr };
+    size_t capacity, shards = 16;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "K|K", const_cast<char**>(keywords),
+                                     &capacity, &shards)) {
+      return nullptr;
+    }
+    return wrap_object(language_vector::make_cache(capacity, shards));
+  }
+
+  PyObject* cached_build(PyObject* /*self*/, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = { "cache", "builder", "text", "addSpace", nullptr };
+    PyObject* pycache;
+    PyObject* pybuilder;
+    const char* text;
+    int addSpace = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOs|p", const_cast<char**>(keywords),
+                                     &pycache, &pybuilder, &text, &addSpace)) {
+      return nullptr;
+    }
+    auto cache = unwrap_object<language_vector::cache>(pycache);
+    auto builder = unwrap_object<language_vector::builder>(pybuilder);
+    return wrap_object(allow_threads([cache, builder, &text, addSpace]
+                                     { return cache->build(*builder, text, addSpace != 0); }));
+  }
+
+  PyObject* cache_stats(PyObject* /*self*/, PyObject* args) {
+    PyObject* pycache;
+    if (!PyArg_ParseTuple(args, "O", &pycache)) {
+      return nullptr;
+    }
+    auto stats = unwrap_object<language_vector::cache>(pycache)->stats();
+    return Py_BuildValue("{s:n,s:n,s:n,s:n}",
+                         "hits", stats.hits,
+                         "misses", stats.misses,
+                         "evictions", stats.evictions,
+                         "size", stats.size);
+  }
+
+  PyObject* cache_clear(PyObject* /*self*/, PyObject* args) {
+    PyObject* pycache;
+    if (!PyArg_ParseTuple(args, "O", &pycache)) {
+      return nullptr;
+    }
+    unwrap_object<language_vector::cache>(pycache)->clear();
+    return Py_BuildValue("");
+  }
+
   // Module definition
 
   PyMethodDef LanguageVectorMethods[] = {
@@ -153,6 +279,17 @@ namespace {
     { "merge", merge, METH_VARARGS, "Merge two language vector" },
     { "wmerge", wmerge, METH_VARARGS, "Merge two language vector with given weight for latter" },
     { "score", score, METH_VARARGS, "Compare two language vectors" },
+    { "prefilter", with_keywords(prefilter), METH_VARARGS | METH_KEYWORDS,
+      "Select languages whose scripts match a text vector ``indices = prefilter(languages, text, fallback=True)``" },
+    { "classify", with_keywords(classify), METH_VARARGS | METH_KEYWORDS,
+      "Classify text, best first (at most k results) "
+      "``[(index, score)] = classify(builder, languages, text, k=1, cache=None, prefilter=True, fallback=True)``" },
+    { "make_cache", with_keywords(make_cache), METH_VARARGS | METH_KEYWORDS,
+      "Create a cache of classification results & text vectors ``cache = make_cache(capacity, shards=16)``" },
+    { "cached_build", with_keywords(cached_build), METH_VARARGS | METH_KEYWORDS,
+      "Build a language vector, reusing cached results ``vector = cached_build(cache, builder, text, addSpace=True)``" },
+    { "cache_stats", cache_stats, METH_VARARGS, "Get hit/miss/eviction statistics for a cache" },
+    { "cache_clear", cache_clear, METH_VARARGS, "Remove all entries from a cache" },
     { nullptr, nullptr, 0, nullptr }
   };
 
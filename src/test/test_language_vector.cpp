@@ -1,6 +1,10 @@
 #include "language_vector.hpp"
 #include <memory>
 #include <iostream>
+#include <sstream>
+#include <clocale>
+#include <algorithm>
+#include <thread>
 #include <catch.hpp>
 
 namespace {
@@ -21,6 +25,16 @@ namespace {
     return std::unique_ptr<language_vector::vector>{(*builder)(lines, addSpace)};
   }
 
+  // Switch LC_CTYPE (which decoding UTF-8 input depends on) for the lifetime of the guard
+  struct locale_guard {
+    std::string previous;
+    bool ok;
+    explicit locale_guard(const char* name)
+      : previous{std::setlocale(LC_CTYPE, nullptr)}, ok{std::setlocale(LC_CTYPE, name) != nullptr} { }
+    locale_guard(const locale_guard&) = delete;
+    ~locale_guard() { std::setlocale(LC_CTYPE, previous.c_str()); }
+  };
+
 } // namespace (anonymous)
 
 using Catch::Detail::Approx;
@@ -140,6 +154,30 @@ TEST_CASE("Language vectors can be serialized/deserialized", "[io]") {
   REQUIRE(language_vector::score(*x_reload, *y_reload) < 0.99f);
 }
 
+TEST_CASE("Vectors saved without a script profile can be loaded", "[io]") {
+  auto builder = make_builder();
+  auto save_old_format = [&builder](const language_vector::vector& v) {
+    std::stringstream stream;
+    builder->save(v, stream);
+    auto saved = stream.str();
+    return saved.substr(0, saved.find("scripts"));
+  };
+
+  std::unique_ptr<language_vector::vector> x{(*builder)("This is some text")};
+  std::unique_ptr<language_vector::vector> y{(*builder)("C'est autres text")};
+  std::stringstream stream(save_old_format(*x) + save_old_format(*y));
+
+  std::unique_ptr<language_vector::vector> x_reload{builder->load(stream)};
+  REQUIRE(stream.good());
+  std::unique_ptr<language_vector::vector> y_reload{builder->load(stream)};
+  REQUIRE(!stream.fail());
+
+  REQUIRE(language_vector::score(*x, *x_reload) == Approx(1));
+  REQUIRE(language_vector::score(*y, *y_reload) == Approx(1));
+  // without a profile, any text is compatible
+  REQUIRE(language_vector::compatible(*x_reload, *build("\u3053\u3093")));
+}
+
 TEST_CASE("Example of larger language vectors", "") {
   auto en = build("this is an impossibly small amount of text, written in English");
   auto en_more = build("another document, also written in the Queen's language");
@@ -151,3 +189,229 @@ TEST_CASE("Example of larger language vectors", "") {
   REQUIRE(language_vector::score(*en, *fr) == Approx(language_vector::score(*fr, *en)));
   REQUIRE(language_vector::score(*en, *fr) < 0.99f);
 }
+
+TEST_CASE("Languages can be prefiltered by script", "[prefilter]") {
+  locale_guard utf8("C.UTF-8");
+  REQUIRE(utf8.ok);
+
+  auto en = build("the quick brown fox jumps over the lazy dog");
+  auto ru = build("\u0441\u044a\u0435\u0448\u044c \u0436\u0435 \u0435\u0449\u0451");
+  auto ko = build("\ud55c\uad6d\uc5b4 \ubb38\uc7a5");
+  std::vector<const language_vector::vector*> languages = {en.get(), ru.get(), ko.get()};
+
+  REQUIRE(language_vector::prefilter(languages, *build("hello world")) == std::vector<std::size_t>{0});
+  REQUIRE(language_vector::prefilter(languages, *build("\u0435\u0449\u0451")) == std::vector<std::size_t>{1});
+  REQUIRE(language_vector::prefilter(languages, *build("\ubb38\uc7a5")) == std::vector<std::size_t>{2});
+
+  // text without letters tells us nothing, so every language is a candidate
+  REQUIRE(language_vector::prefilter(languages, *build("123 !?")).size() == 3);
+
+  // no compatible language => fall back to all of them (unless disabled)
+  auto el = build("\u03b1\u03b2\u03b3");
+  REQUIRE(language_vector::prefilter(languages, *el).size() == 3);
+  REQUIRE(language_vector::prefilter(languages, *el, false).empty());
+
+  // the script profile survives merging & serialization
+  language_vector::merge(*en, *build("\u0435\u0449\u0451"));
+  REQUIRE(language_vector::compatible(*en, *build("\u0435\u0449\u0451")));
+  auto builder = make_builder();
+  std::stringstream stream;
+  builder->save(*ko, stream);
+  std::unique_ptr<language_vector::vector> ko_reload{builder->load(stream)};
+  REQUIRE(language_vector::compatible(*ko_reload, *build("\ubb38\uc7a5")));
+  REQUIRE(!language_vector::compatible(*ko_reload, *build("hello")));
+
+  // punctuation, symbols & emoji don't count towards a script (even if used heavily in
+  // CJK text), but fullwidth letters count as their ASCII equivalents
+  auto zh = build("\u4f60\u597d\uff0c\u4e16\u754c\uff01\u3002");
+  std::vector<const language_vector::vector*> en_zh = {en.get(), zh.get()};
+  REQUIRE(language_vector::prefilter(en_zh, *build("ok \U0001f600\U0001f600\U0001f600")) == std::vector<std::size_t>{0});
+  REQUIRE(language_vector::prefilter(en_zh, *build("\uff4f\uff4b\uff01")) == std::vector<std::size_t>{0});
+  REQUIRE(language_vector::prefilter(en_zh, *build("\u4e16\u754c\uff01")) == std::vector<std::size_t>{1});
+
+  // scripts without a bucket of their own (e.g. Ethiopic, Khmer, Myanmar) aren't
+  // mistaken for any other script
+  auto ja = build("\u3053\u3093\u306b\u3061\u306f");
+  std::vector<const language_vector::vector*> en_ja = {en.get(), ja.get()};
+  REQUIRE(language_vector::prefilter(en_ja, *build("\u1230\u120b\u121d")).size() == 2);
+  REQUIRE(language_vector::prefilter(en_ja, *build("\u179f\u17bd\u179f\u17d2\u178f\u17b8")).size() == 2);
+  REQUIRE(language_vector::prefilter(en_ja, *build("\u1019\u1004\u103a\u1039\u1002\u101c\u102c")).size() == 2);
+  REQUIRE(!language_vector::compatible(*ja, *build("hello")));
+
+  // ... but scripts' extension blocks are, and signs, byte order marks etc. are common
+  auto ka = build("\u10d2\u10d0\u10db\u10d0\u10e0\u10ef\u10dd\u10d1\u10d0");
+  REQUIRE(language_vector::prefilter({en.get(), ka.get()}, *build("\u2d00\u2d01")) == std::vector<std::size_t>{1});
+  REQUIRE(language_vector::prefilter(en_zh, *build("\u2c65\u2c66")) == std::vector<std::size_t>{0});
+  REQUIRE(language_vector::prefilter({ja.get(), ru.get()}, *build("\u0435\u2de0")) == std::vector<std::size_t>{1});
+  REQUIRE(language_vector::prefilter(en_zh, *build("\ufeff\u4e16\u754c")) == std::vector<std::size_t>{1});
+  REQUIRE(language_vector::prefilter(en_zh, *build("2 \u00d7 3 \u00f7 4")).size() == 2);
+}
+
+TEST_CASE("Prefiltering keeps languages matching part of mixed-script text", "[prefilter]") {
+  locale_guard utf8("C.UTF-8");
+  REQUIRE(utf8.ok);
+
+  auto en = build("I bought a new phone yesterday and it works very well");
+  auto ja = build("\u304d\u306e\u3046\u65b0\u3057\u3044\u96fb\u8a71\u3092\u8cb7\u3044\u307e\u3057\u305f");
+  auto ru = build("\u0432\u0447\u0435\u0440\u0430 \u044f \u043a\u0443\u043f\u0438\u043b "
+                  "\u043d\u043e\u0432\u044b\u0439 \u0442\u0435\u043b\u0435\u0444\u043e\u043d");
+  std::vector<const language_vector::vector*> languages = {en.get(), ja.get(), ru.get()};
+
+  // the best match with prefiltering should be the best match without it
+  auto best = [&languages](const language_vector::vector& text, const std::vector<std::size_t>& candidates) {
+    return *std::max_element(std::begin(candidates), std::end(candidates),
+                             [&](std::size_t a, std::size_t b) {
+                               return language_vector::score(*languages[a], text) <
+                                 language_vector::score(*languages[b], text);
+                             });
+  };
+  for (auto text : {"\u041a\u0443\u043f\u0438\u043b iPhone",
+                    "\u041a\u0443\u043f\u0438\u043b Samsung Galaxy"}) {
+    auto text_vector = build(text);
+    auto candidates = language_vector::prefilter(languages, *text_vector);
+    REQUIRE(candidates == (std::vector<std::size_t>{0, 2}));
+    REQUIRE(best(*text_vector, candidates) == best(*text_vector, {0, 1, 2}));
+    REQUIRE(best(*text_vector, candidates) == 2);
+  }
+}
+
+TEST_CASE("Text can be classified", "[classify]") {
+  auto builder = make_builder();
+  std::unique_ptr<language_vector::vector> en{(*builder)("the cat sat on the mat")};
+  std::unique_ptr<language_vector::vector> fr{(*builder)("le chat est sur le tapis")};
+  std::vector<const language_vector::vector*> languages = {en.get(), fr.get()};
+
+  auto result = language_vector::classify(*builder, languages, "the mat", 2);
+  REQUIRE(result.size() == 2);
+  REQUIRE(result[0].first == 0);
+  REQUIRE(result[0].second >= result[1].second);
+  REQUIRE(language_vector::classify(*builder, languages, "le chat")[0].first == 1);
+  REQUIRE(language_vector::classify(*builder, {}, "le chat").empty());
+
+  // at most 'k' results, and fewer if fewer languages pass the prefilter
+  REQUIRE(language_vector::classify(*builder, languages, "the mat", 5).size() == 2);
+  locale_guard utf8("C.UTF-8");
+  REQUIRE(utf8.ok);
+  const std::string greek = "\u03b1\u03b2\u03b3";
+  REQUIRE(language_vector::classify(*builder, languages, greek, 2).size() == 2);
+  REQUIRE(language_vector::classify(*builder, languages, greek, 2,
+                                    language_vector::prefilter_strict).empty());
+  REQUIRE(language_vector::classify(*builder, languages, "le chat", 2,
+                                    language_vector::prefilter_strict).size() == 2);
+  std::unique_ptr<language_vector::vector> el{(*builder)(greek)};
+  languages.push_back(el.get());
+  REQUIRE(language_vector::classify(*builder, languages, "le chat", 3).size() == 2);
+  REQUIRE(language_vector::classify(*builder, languages, "le chat", 3,
+                                    language_vector::prefilter_none).size() == 3);
+}
+
+TEST_CASE("Classification results & text vectors can be cached", "[cache]") {
+  auto builder = make_builder();
+  std::unique_ptr<language_vector::vector> en{(*builder)("the cat sat on the mat")};
+  std::unique_ptr<language_vector::vector> fr{(*builder)("le chat est sur le tapis")};
+  std::vector<const language_vector::vector*> languages = {en.get(), fr.get()};
+  std::unique_ptr<language_vector::cache> cache{language_vector::make_cache(2, 1)};
+
+  auto first = cache->classify(*builder, languages, "the mat");
+  auto second = cache->classify(*builder, languages, "the mat");
+  REQUIRE(first == second);
+  REQUIRE(cache->stats().hits == 1);
+  REQUIRE(cache->stats().misses == 1);
+
+  // a different k, builder or language version is a different entry
+  cache->classify(*builder, languages, "the mat", 2);
+  REQUIRE(cache->stats().misses == 2);
+  language_vector::merge(*en, *build("le chat"));
+  cache->classify(*builder, languages, "the mat");
+  REQUIRE(cache->stats().misses == 3);
+  std::stringstream stream;
+  builder->save(*fr, stream);
+  fr.reset(builder->load(stream));
+  languages[1] = fr.get();
+  cache->classify(*builder, languages, "the mat");
+  REQUIRE(cache->stats().misses == 4);
+
+  // least recently used entries are evicted once full
+  REQUIRE(cache->stats().size == 2);
+  REQUIRE(cache->stats().evictions == 2);
+
+  // cached text vectors are copies of the original
+  std::unique_ptr<language_vector::vector> built{cache->build(*builder, "abc 123")};
+  std::unique_ptr<language_vector::vector> rebuilt{cache->build(*builder, "abc 123")};
+  REQUIRE(language_vector::score(*built, *rebuilt) == Approx(1));
+  REQUIRE(language_vector::score(*rebuilt, *build("abc 123")) == Approx(1));
+  std::unique_ptr<language_vector::vector> unspaced{cache->build(*builder, "abc 123", false)};
+  REQUIRE(language_vector::score(*unspaced, *build("abc 123")) < 0.99f);
+
+  cache->clear();
+  REQUIRE(cache->stats().size == 0);
+  REQUIRE(cache->stats().hits == 2);
+}
+
+TEST_CASE("Cached classifications & text vectors are kept apart", "[cache]") {
+  auto builder = make_builder();
+  std::unique_ptr<language_vector::cache> cache{language_vector::make_cache(16)};
+
+  // an (empty) classification must not be mistaken for a text vector
+  REQUIRE(cache->classify(*builder, {}, "hello", 0).empty());
+  REQUIRE(cache->classify(*builder, {}, "hello", 1).empty());
+  std::unique_ptr<language_vector::vector> built{cache->build(*builder, "hello")};
+  REQUIRE(language_vector::score(*built, *build("hello")) == Approx(1));
+  REQUIRE(cache->stats().hits == 0);
+}
+
+TEST_CASE("Cache capacity is a strict bound", "[cache]") {
+  auto builder = make_builder();
+  std::unique_ptr<language_vector::cache> cache{language_vector::make_cache(17, 16)};
+  for (auto i = 0; i < 100; ++i) {
+    cache->classify(*builder, {}, std::to_string(i));
+  }
+  REQUIRE(cache->stats().size <= 17);
+  REQUIRE(cache->stats().evictions == 100 - cache->stats().size);
+}
+
+TEST_CASE("Caches can be shared between threads", "[cache]") {
+  auto builder = make_builder();
+  std::unique_ptr<language_vector::vector> en{(*builder)("the cat sat on the mat")};
+  std::unique_ptr<language_vector::vector> fr{(*builder)("le chat est sur le tapis")};
+  std::vector<const language_vector::vector*> languages = {en.get(), fr.get()};
+  std::unique_ptr<language_vector::cache> cache{language_vector::make_cache(8, 4)};
+
+  std::vector<std::string> texts;
+  std::vector<language_vector::results> expected;
+  for (auto i = 0; i < 12; ++i) {
+    texts.push_back((i % 2 ? "the mat " : "le chat ") + std::to_string(i));
+    expected.push_back(language_vector::classify(*builder, languages, texts.back(), 2));
+  }
+
+  // classify & build from several threads (checking results once they're all done)
+  const auto nthreads = 4u;
+  const auto ncalls = 100u;
+  std::vector<std::vector<bool>> correct(nthreads);
+  std::vector<std::thread> threads;
+  for (auto t = 0u; t < nthreads; ++t) {
+    threads.emplace_back([&, t] {
+        for (auto i = 0u; i < ncalls; ++i) {
+          const auto idx = (7 * i + t) % texts.size();
+          if (i % 2) {
+            correct[t].push_back(cache->classify(*builder, languages, texts[idx], 2) == expected[idx]);
+          } else {
+            std::unique_ptr<language_vector::vector> built{cache->build(*builder, texts[idx])};
+            std::unique_ptr<language_vector::vector> uncached{(*builder)(texts[idx])};
+            correct[t].push_back(language_vector::score(*built, *uncached) > 0.999f);
+          }
+        }
+      });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (auto& thread_correct : correct) {
+    REQUIRE(thread_correct == std::vector<bool>(ncalls, true));
+  }
+  auto stats = cache->stats();
+  REQUIRE(stats.hits + stats.misses == nthreads * ncalls);
+  REQUIRE(stats.size <= 8);
+  REQUIRE(stats.evictions + stats.size <= stats.misses);
+}
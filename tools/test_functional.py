@@ -28,7 +28,9 @@ def _build_language(builder, language, path, start, count):
 def _classify(builder, language_vectors, text):
     """Classify the given text (single string) under the given map of language vectors."""
     text_vector = langrv.build(builder, text)
-    return max(language_vectors.keys(),
+    languages = list(language_vectors.keys())
+    candidates = langrv.prefilter([language_vectors[language] for language in languages], text_vector)
+    return max((languages[i] for i in candidates),
                key=lambda language: langrv.score(language_vectors[language], text_vector))
 
 def _classify_lines(builder, actual_language, language_vectors, path, start, count):